@@ -0,0 +1,374 @@
+/*
+Long-term per-network RSSI history.
+
+Every network gets a series of (time, rssi) samples. Samples are packed into
+fixed size blocks taken from one shared pool (in PSRAM if there is one):
+ - time (seconds) is stored as delta-of-delta
+ - rssi is stored as a zig-zag delta from the previous rssi
+both with short prefix codes. A real scan (period jitter of a second, rssi
+noise of +-2 dB) costs about 7 bits per sample with the block headers; only
+a constant period and a constant rssi get down to 2 bits.
+
+rssi==0 means "network not seen in this scan" (same as in `scans`).
+
+Old blocks are downsampled by compact(): two neighbour blocks of the same
+level are decoded, every 2 samples are averaged and the result is written
+back into one block of the next level.
+
+No Arduino dependencies except the allocator, so it can be built on the host.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define HISTORY_BLOCK_SIZE 128
+//level L block holds 2^L averaged samples per sample
+#define HISTORY_LEVELS 5
+//seconds; level L block is downsampled when it is older than HISTORY_DOWNSAMPLE_AGE<<L
+#define HISTORY_DOWNSAMPLE_AGE 600
+#define HISTORY_NONE 0xFFFF
+
+struct historyblock {
+    uint16_t next;   //next block of the series or HISTORY_NONE
+    uint16_t series;
+    uint32_t t0;     //first sample time
+    uint32_t t1;     //last sample time
+    int32_t delta;   //last time delta
+    uint16_t bits;   //used bits of payload
+    uint16_t count;  //samples in the block
+    int8_t r1;       //last seen rssi
+    uint8_t level;
+    uint8_t payload[HISTORY_BLOCK_SIZE-22];
+};
+static_assert(sizeof(historyblock)==HISTORY_BLOCK_SIZE, "historyblock size");
+
+struct historysample {
+    uint32_t t;
+    int8_t rssi;
+};
+
+class RssiHistory
+{
+public:
+    ~RssiHistory() { free(_pool); }
+
+    //blocks <= 0xFFFE
+    bool begin(uint16_t blocks) {
+        free(_pool);
+        size_t size = (size_t)blocks*sizeof(historyblock);
+#ifdef ARDUINO
+        _pool = (historyblock*)(psramFound() ? ps_malloc(size) : malloc(size));
+#else
+        _pool = (historyblock*)malloc(size);
+#endif
+        _blocks = _pool ? blocks : 0;
+        clear();
+        return _pool!=nullptr;
+    }
+
+    void clear() {
+        _series.clear();
+        _samples = 0;
+        _used = 0;
+        _free = HISTORY_NONE;
+        for (int i=_blocks-1; i>=0; i--) {
+            _pool[i].next = _free;
+            _free = i;
+        }
+    }
+
+    int addSeries() {
+        _series.push_back(series{HISTORY_NONE,HISTORY_NONE});
+        return _series.size()-1;
+    }
+
+    //false if the pool is exhausted and nothing can be evicted
+    bool append(int s, uint32_t t, int32_t rssi) {
+        if (s<0 || s>=(int)_series.size()) return false;
+        int8_t r = rssi<-127 ? -127 : (rssi>0 ? 0 : rssi);
+        series &ser = _series[s];
+        if (ser.tail!=HISTORY_NONE && encode(_pool[ser.tail],t,r)) {
+            _samples++;
+            return true;
+        }
+
+        uint16_t i = alloc();
+        if (i==HISTORY_NONE) return false;
+        start(_pool[i],s,t,0);
+        encode(_pool[i],t,r);
+        if (ser.tail!=HISTORY_NONE) _pool[ser.tail].next = i;
+        else ser.head = i;
+        ser.tail = i;
+        _samples++;
+        return true;
+    }
+
+    //calls f(t,rssi) for samples of series s with from<=t<=to; decodes only the blocks in range
+    template<typename F> int query(int s, uint32_t from, uint32_t to, F f) const {
+        if (s<0 || s>=(int)_series.size()) return 0;
+        int n = 0;
+        for (uint16_t i=_series[s].head; i!=HISTORY_NONE; i=_pool[i].next) {
+            const historyblock &b = _pool[i];
+            if (b.t0>to) break;
+            if (b.t1<from) continue;
+            decode(b,[&](uint32_t t, int8_t r){
+                if (t>=from && t<=to) { f(t,r); n++; }
+            });
+        }
+        return n;
+    }
+
+    //downsample old blocks; call it from time to time
+    void compact(uint32_t now) {
+        for (series &ser : _series) {
+            uint16_t a = ser.head;
+            while (a!=HISTORY_NONE) {
+                uint16_t b = _pool[a].next;
+                if (b==HISTORY_NONE || b==ser.tail) break; //never touch the block we are writing to
+                const historyblock &A = _pool[a];
+                const historyblock &B = _pool[b];
+                if (A.level==B.level && A.level+1<HISTORY_LEVELS &&
+                    (int32_t)(now-B.t1) > (HISTORY_DOWNSAMPLE_AGE<<A.level) &&
+                    merge(a,b)) continue; //check the merged block again
+                a = b;
+            }
+        }
+    }
+
+    uint32_t samples() const { return _samples; }
+    uint32_t usedBytes() const { return (uint32_t)_used*sizeof(historyblock); }
+    uint32_t totalBytes() const { return (uint32_t)_blocks*sizeof(historyblock); }
+    //x100
+    uint32_t bitsPerSample() const { return _samples ? (uint64_t)usedBytes()*800/_samples : 0; }
+
+private:
+    struct series {
+        uint16_t head;
+        uint16_t tail;
+    };
+
+    struct bitwriter {
+        uint64_t v = 0;
+        uint8_t n = 0;
+        void put(uint32_t x, uint8_t w) {
+            if (w<32) x &= (1UL<<w)-1;
+            v |= (uint64_t)x<<n;
+            n += w;
+        }
+        //k ones and a zero; k==max: just ones
+        void prefix(uint8_t k, uint8_t max) { put((1UL<<k)-1, k<max ? k+1 : k); }
+    };
+
+    struct bitreader {
+        const uint8_t *p;
+        uint32_t pos = 0;
+        bitreader(const uint8_t *payload) : p(payload) {}
+        uint32_t get(uint8_t w) {
+            uint32_t x = 0;
+            uint8_t got = 0;
+            while (got<w) {
+                uint8_t off = pos&7;
+                uint8_t take = 8-off < w-got ? 8-off : w-got;
+                x |= (uint32_t)((p[pos>>3]>>off) & ((1<<take)-1)) << got;
+                got += take;
+                pos += take;
+            }
+            return x;
+        }
+        uint8_t prefix(uint8_t max) {
+            uint8_t k = 0;
+            while (k<max && get(1)) k++;
+            return k;
+        }
+    };
+
+    static uint32_t zz(int32_t x) { return ((uint32_t)x<<1) ^ (uint32_t)(x>>31); }
+    static int32_t unzz(uint32_t u) { return (int32_t)(u>>1) ^ -(int32_t)(u&1); }
+
+    static void start(historyblock &b, uint16_t s, uint32_t t, uint8_t level) {
+        b.next = HISTORY_NONE;
+        b.series = s;
+        b.t0 = b.t1 = t;
+        b.delta = 0;
+        b.bits = 0;
+        b.count = 0;
+        b.r1 = 0;
+        b.level = level;
+        memset(b.payload,0,sizeof(b.payload));
+    }
+
+    /*
+    first sample: 7 bit raw -rssi, time is t0
+    time:  0 - same delta; 10+1 bit, 110+5 bits, 1110+12 bits: zz(dod)-1; 1111+32 bits: dod
+    rssi:  0 - same rssi; 10+2 bits, 110+5 bits: zz(diff)-1; 1110 - lost; 1111+7 bits: -rssi
+    */
+    static bool encode(historyblock &b, uint32_t t, int8_t r) {
+        bitwriter w;
+        int32_t delta = b.delta;
+        int8_t r1 = r;
+        if (b.count==0) {
+            w.put(-r,7);
+        } else {
+            delta = (int32_t)(t-b.t1);
+            int32_t dod = delta-b.delta;
+            uint32_t u = zz(dod)-1;
+            if (dod==0) w.prefix(0,4);
+            else if (u<2) { w.prefix(1,4); w.put(u,1); }
+            else if (u<32) { w.prefix(2,4); w.put(u,5); }
+            else if (u<4096) { w.prefix(3,4); w.put(u,12); }
+            else { w.prefix(4,4); w.put((uint32_t)dod,32); }
+
+            int32_t diff = r-b.r1;
+            u = zz(diff)-1;
+            if (r==0 && b.r1!=0) { w.prefix(3,4); r1 = b.r1; }
+            else if (diff==0) w.prefix(0,4);
+            else if (u<4) { w.prefix(1,4); w.put(u,2); }
+            else if (u<32) { w.prefix(2,4); w.put(u,5); }
+            else { w.prefix(4,4); w.put(-r,7); }
+        }
+        if (b.bits+w.n > sizeof(b.payload)*8) return false;
+
+        uint32_t pos = b.bits;
+        uint64_t v = w.v;
+        uint8_t n = w.n;
+        while (n) {
+            uint8_t off = pos&7;
+            uint8_t take = 8-off < n ? 8-off : n;
+            b.payload[pos>>3] |= (uint8_t)((v & ((1<<take)-1)) << off);
+            v >>= take;
+            n -= take;
+            pos += take;
+        }
+        b.bits = pos;
+        if (b.count==0) b.t0 = t;
+        b.t1 = t;
+        b.delta = delta;
+        b.r1 = r1;
+        b.count++;
+        return true;
+    }
+
+    template<typename F> static void decode(const historyblock &b, F f) {
+        if (b.count==0) return;
+        bitreader rd(b.payload);
+        uint32_t t = b.t0;
+        int32_t delta = 0;
+        int8_t r1 = -(int8_t)rd.get(7);
+        f(t,r1);
+        for (int i=1; i<b.count; i++) {
+            switch (rd.prefix(4)) {
+                case 0: break;
+                case 1: delta += unzz(rd.get(1)+1); break;
+                case 2: delta += unzz(rd.get(5)+1); break;
+                case 3: delta += unzz(rd.get(12)+1); break;
+                default: delta += (int32_t)rd.get(32);
+            }
+            t += delta;
+
+            int8_t r;
+            switch (rd.prefix(4)) {
+                case 0: r = r1; break;
+                case 1: r = r1 = r1+unzz(rd.get(2)+1); break;
+                case 2: r = r1 = r1+unzz(rd.get(5)+1); break;
+                case 3: r = 0; break;
+                default: r = r1 = -(int8_t)rd.get(7);
+            }
+            f(t,r);
+        }
+    }
+
+    //a and b are neighbours of the same series; false if nothing changed
+    bool merge(uint16_t a, uint16_t b) {
+        historyblock &A = _pool[a];
+        historyblock &B = _pool[b];
+        _tmp.clear();
+        auto push = [&](uint32_t t, int8_t r){ _tmp.push_back(historysample{t,r}); };
+        decode(A,push);
+        decode(B,push);
+        if (_tmp.empty()) return false;
+
+        //average every 2 samples; lost only if both are lost
+        //halves are rounded to even: both truncation and rounding away from 0 drift over the levels
+        size_t n = 0;
+        for (size_t i=0; i<_tmp.size(); i+=2) {
+            historysample s = _tmp[i];
+            if (i+1<_tmp.size()) {
+                int8_t r2 = _tmp[i+1].rssi;
+                if (s.rssi==0) s.rssi = r2;
+                else if (r2!=0) {
+                    int sum = s.rssi+r2;
+                    int avg = sum>>1; //floor
+                    if ((sum&1) && (avg&1)) avg++;
+                    s.rssi = avg;
+                }
+            }
+            _tmp[n++] = s;
+        }
+        _tmp.resize(n);
+
+        //write into scratch blocks first: the result must fit into A and B
+        int k = 0;
+        start(_scratch[0],A.series,_tmp[0].t,A.level+1);
+        for (historysample &s : _tmp) {
+            if (encode(_scratch[k],s.t,s.rssi)) continue;
+            if (k==1) return false;
+            start(_scratch[++k],A.series,s.t,A.level+1);
+            encode(_scratch[k],s.t,s.rssi);
+        }
+
+        uint16_t next = B.next;
+        _samples += n;
+        _samples -= A.count+B.count;
+        A = _scratch[0];
+        if (k==1) {
+            A.next = b;
+            B = _scratch[1];
+            B.next = next;
+        } else {
+            A.next = next;
+            release(b);
+        }
+        return true;
+    }
+
+    uint16_t alloc() {
+        if (_free==HISTORY_NONE) evict();
+        if (_free==HISTORY_NONE) return HISTORY_NONE;
+        uint16_t i = _free;
+        _free = _pool[i].next;
+        _used++;
+        return i;
+    }
+
+    void release(uint16_t i) {
+        _pool[i].next = _free;
+        _free = i;
+        _used--;
+    }
+
+    //drop the oldest block of all series; keeps the block each series writes to
+    void evict() {
+        series *oldest = nullptr;
+        for (series &ser : _series) {
+            if (ser.head==ser.tail) continue;
+            if (!oldest || _pool[ser.head].t0<_pool[oldest->head].t0) oldest = &ser;
+        }
+        if (!oldest) return;
+        uint16_t i = oldest->head;
+        oldest->head = _pool[i].next;
+        _samples -= _pool[i].count;
+        release(i);
+    }
+
+    historyblock *_pool = nullptr;
+    uint16_t _blocks = 0;
+    uint16_t _used = 0;
+    uint16_t _free = HISTORY_NONE;
+    uint32_t _samples = 0;
+    std::vector<series> _series;
+    std::vector<historysample> _tmp;
+    historyblock _scratch[2];
+};
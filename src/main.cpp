@@ -16,6 +16,11 @@ Created by Denis, 2023. Thanks for https://github.com/LieBtrau
 
 #include <Arduino.h>
 #include "WiFi.h"
+#include "history.h"
+#include "powersave.h"
+#include "esp_sleep.h"
+#include "esp_wifi.h"
+#include "driver/uart.h"
 
 #define SCANS_COUNT 50
 //set 0 to auto detect
@@ -23,6 +28,25 @@ Created by Denis, 2023. Thanks for https://github.com/LieBtrau
 //set -127 to auto detect
 #define SCANS_MAX -30
 
+//history pool blocks (HISTORY_BLOCK_SIZE bytes each)
+#define HISTORY_BLOCKS_PSRAM 16384
+#define HISTORY_BLOCKS 256
+//seconds between history downsampling passes
+#define HISTORY_COMPACT_PERIOD 60
+
+//2.4GHz channels 1..14
+#define CHANNELS_COUNT 14
+//seconds; a network not seen for longer is removed from the channel view and its history is paused
+#define CHANNEL_STALE 60
+//dB counted as a change for a network that appears, disappears or moves to another channel (>= SCHED_CHANGE_DB)
+#define CHANNEL_CHANGE_DB 10
+//dBm range of the channel power bars
+#define CHANNEL_BAR_MIN -95
+#define CHANNEL_BAR_MAX -25
+
+//cpu frequency while idle in power saving modes (80 is the lowest that keeps wifi working)
+#define IDLE_CPU_MHZ 80
+
 //-----------------------------------------------------------------------------------
 //Xterm
 typedef enum{
@@ -189,8 +213,10 @@ Xterm xterm=Xterm(&Serial);
 //----------------------------------------------------------------------------------
 bool writeScreen();
 bool writeScreen1(String ssid);
+bool writeScreenChannels();
 void drawMode0Xterm(int n);
 void drawMode0(int n);
+void drawChannelsXterm();
 
 void drawMode1XtermFrameIfNeeded(bool rebuild);
 
@@ -202,6 +228,7 @@ void writeMid(int row);
 void writeBot(int row);
 
 void checkInput();
+void idle();
 
 bool useXterm = false;
 int vmode = 0; //global visualization mode
@@ -224,13 +251,46 @@ struct datatype {
     int mesh_size;
 };
 
+//access points: one network (SSID) can have many, hidden ones share the empty SSID
+//channel view and history are kept per AP
+struct aptype {
+    uint8_t bssid[6];
+    String name;
+    int channel;
+    int lastRSSI;
+    unsigned long last;
+    int counter_tag; //last scan the AP was seen in
+    int history;     //series in `history`
+
+    //what the AP adds to `channels` now (0 - nothing)
+    int occ_channel;
+    int occ_rssi;
+};
+
 #include <vector>
 
 std::vector<datatype> data;
+std::vector<aptype> aps;
 std::vector<int32_t> scans;
 int32_t scans_min = 0;
 int32_t scans_max = -127;
 
+//per channel aggregates, updated in scanNetworks()
+struct channeltype {
+    int count;
+    uint64_t power;       //sum of linear power, 1e-12 mW units
+    int strongest;
+    int weakest;
+    uint16_t hist[128];   //networks by -rssi
+};
+channeltype channels[CHANNELS_COUNT+1]; //[0] is not used
+
+RssiHistory history;
+uint32_t history_compacted = 0;
+
+ScanScheduler scheduler;
+int scan_change = 0; //percent of the networks changed in the last scan
+
 int rc=0;
 String cmd = "";
 String ssid = ""; //ssid to indicate
@@ -264,12 +324,59 @@ void setup() {
   delay(5);//5ms
 
 
+  history.begin(psramFound() ? HISTORY_BLOCKS_PSRAM : HISTORY_BLOCKS);
+
   set_xterm();
   
   WiFi.mode(WIFI_STA);
   WiFi.disconnect();
 }
 
+uint64_t rssiPower(int rssi) {
+    return llround(pow(10.0,(rssi+120)/10.0));
+}
+
+void channelAdd(int ch, int rssi) {
+    channeltype &c = channels[ch];
+    c.hist[-rssi]++;
+    c.power += rssiPower(rssi);
+    if (c.count==0 || c.strongest<rssi) c.strongest = rssi;
+    if (c.count==0 || c.weakest>rssi) c.weakest = rssi;
+    c.count++;
+}
+
+void channelRemove(int ch, int rssi) {
+    channeltype &c = channels[ch];
+    c.hist[-rssi]--;
+    c.power -= rssiPower(rssi);
+    c.count--;
+    if (c.count==0) {
+        c.power = 0;
+        c.strongest = c.weakest = 0;
+        return;
+    }
+    //removed the last one with the extreme value: look for the next one
+    if (rssi==c.strongest) while (c.hist[-c.strongest]==0) c.strongest--;
+    if (rssi==c.weakest) while (c.hist[-c.weakest]==0) c.weakest++;
+}
+
+//bring the AP contribution to `channels` up to date; returns the change, dB
+int updateChannels(aptype &d) {
+    int ch = 0;
+    int rssi = 0;
+    if ((millis()-d.last)/1000 <= CHANNEL_STALE && d.channel>=1 && d.channel<=CHANNELS_COUNT) {
+        ch = d.channel;
+        rssi = d.lastRSSI<-127 ? -127 : (d.lastRSSI>0 ? 0 : d.lastRSSI);
+    }
+    if (ch==d.occ_channel && rssi==d.occ_rssi) return 0;
+    int change = ch==d.occ_channel ? abs(rssi-d.occ_rssi) : CHANNEL_CHANGE_DB;
+    if (d.occ_channel) channelRemove(d.occ_channel,d.occ_rssi);
+    if (ch) channelAdd(ch,rssi);
+    d.occ_channel = ch;
+    d.occ_rssi = rssi;
+    return change;
+}
+
 int current_tag = 0;
 int scanNetworks() {
     int n = WiFi.scanNetworks();
@@ -318,10 +425,135 @@ int scanNetworks() {
           mesh_counter:1,
           mesh_size:1
         });
+
+        uint8_t *bssid = WiFi.BSSID(i);
+        found = false;
+        for (auto &a : aps) {
+            if (memcmp(a.bssid,bssid,6) == 0) {
+                found = true;
+                a.channel = WiFi.channel(i);
+                a.lastRSSI = WiFi.RSSI(i);
+                a.last = millis();
+                a.counter_tag = current_tag;
+                break;
+            }
+        }
+        if (!found) {
+            aps.push_back(aptype{
+              bssid:{0},
+              name:WiFi.SSID(i),
+              channel:WiFi.channel(i),
+              lastRSSI:WiFi.RSSI(i),
+              last:millis(),
+              counter_tag:current_tag,
+              history:history.addSeries(),
+
+              occ_channel:0,
+              occ_rssi:0
+            });
+            memcpy(aps.back().bssid,bssid,6);
+        }
     }
+
+    //APs not seen in this scan are stored as lost until they go stale
+    uint32_t now = millis()/1000;
+    for (auto &a : aps) {
+        if ((millis()-a.last)/1000 <= CHANNEL_STALE)
+            history.append(a.history, now, a.counter_tag==current_tag ? a.lastRSSI : 0);
+    }
+
+    //share of the APs in the air that really changed: stale ones would dilute it
+    int changed = 0;
+    int active = 0;
+    for (auto &a : aps) {
+        if (updateChannels(a)>=SCHED_CHANGE_DB) changed++;
+        if (a.occ_channel) active++;
+    }
+    scan_change = scanChange(changed,active);
     return n;
 }
 
+//dump the whole history of every AP of the network as csv
+void printHistory(datatype &d) {
+    Serial.printf("\n# %s; %u samples in history, %u of %u bytes used, %u.%02u bits/sample\n",
+        d.name.c_str(),history.samples(),history.usedBytes(),history.totalBytes(),history.bitsPerSample()/100,history.bitsPerSample()%100);
+    for (auto &a : aps) if (a.name == d.name) {
+        Serial.printf("# %02x:%02x:%02x:%02x:%02x:%02x channel %d\n",
+            a.bssid[0],a.bssid[1],a.bssid[2],a.bssid[3],a.bssid[4],a.bssid[5],a.channel);
+        Serial.printf("time,rssi\n");
+        history.query(a.history,0,UINT32_MAX,[](uint32_t t, int8_t rssi){ Serial.printf("%u,%d\n",t,rssi); });
+    }
+}
+
+const char* getPowerMode(POWERMODE m) {
+    switch (m) {
+        case POWER_MODEM: return "modem sleep";
+        case POWER_LIGHT: return "light sleep";
+        default: return "awake";
+    };
+}
+
+//fits into the 67 columns of the screen
+String powerStat() {
+    char s[68];
+    snprintf(s,sizeof(s),"%s; idle %ums; scan duty %u.%u%%; %umJ/scan; avg %umW",
+        getPowerMode(scheduler.mode),scheduler.interval(),scheduler.dutyCycle()/10,scheduler.dutyCycle()%10,
+        scheduler.energyPerScan(),scheduler.averagePower());
+    return s;
+}
+
+void setPowerMode(POWERMODE m) {
+#if ARDUINO_USB_CDC_ON_BOOT
+    //usb does not survive light sleep
+    if (m==POWER_LIGHT) m = POWER_AWAKE;
+#endif
+    POWERMODE old = scheduler.mode;
+    scheduler.mode = m;
+    if (m==POWER_LIGHT) {
+        //wake on input; the characters that wake the chip are lost
+        uart_set_wakeup_threshold(UART_NUM_0, 3);
+        esp_sleep_enable_uart_wakeup(UART_NUM_0);
+    } else if (old==POWER_LIGHT) {
+        //disabling a source that is not enabled logs an error
+        esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_UART);
+    }
+}
+
+//wait for the next scan, handling the input meanwhile
+//the radio is stopped in both power saving modes: power save of the wifi driver works only when connected
+void idle() {
+    scheduler.setInterval(scandelay);
+    POWERMODE m = scheduler.mode;
+    if (m==POWER_AWAKE) {
+        //same as before: input is handled after the delay
+        delay(scandelay);
+        return;
+    }
+
+    uint32_t cpu = getCpuFrequencyMhz();
+    setCpuFrequencyMhz(IDLE_CPU_MHZ);
+    esp_wifi_stop();
+    Serial.flush();
+    while (uint32_t t = scheduler.sleepTime(millis())) {
+        if (scheduler.lightSleep(millis())) {
+            esp_sleep_enable_timer_wakeup(t*1000ULL);
+            esp_light_sleep_start();
+            //the waking character is lost: stay awake for the next ones
+            if (esp_sleep_get_wakeup_cause()==ESP_SLEEP_WAKEUP_UART) scheduler.input(millis());
+        } else {
+            delay(t);
+        }
+        if (Serial.available()) {
+            scheduler.input(millis());
+            checkInput();
+            Serial.flush();
+            if (scheduler.mode!=m) break; //mode changed: scan now, next idle uses the new one
+        }
+    }
+    esp_wifi_start();
+    setCpuFrequencyMhz(cpu);
+}
+
 void checkInput() {
     while (Serial.available()) {
         char c = Serial.read();
@@ -353,9 +585,22 @@ void checkInput() {
         } else if (c == '/') {
             set_xterm(!useXterm);
         } else if (c == '*') {
-            vmode = (vmode + 1) % 2; //we have 2 modes now
+            //list: 3 modes, 2 - channels; graph: new / old graph only
+            if (ssid.isEmpty()) vmode = (vmode + 1) % 3;
+            else vmode = vmode==0 ? 1 : 0;
+            if (useXterm && ssid.isEmpty()) writeScreen();
+        } else if (c == 'h') {
+            //csv would break the xterm screen
+            if (!useXterm && cmd.length()>0 && cmd.toInt()>0 && cmd.toInt()<=data.size()) printHistory(data[cmd.toInt()-1]);
+            cmd = "";
+        } else if (c == 'p') {
+            setPowerMode((POWERMODE)((scheduler.mode + 1) % 3));
+            cmd = "";
         } else if (c == 'r') {
             data.clear();
+            history.clear();
+            aps.clear();
+            memset(channels,0,sizeof(channels));
         } else {
             cmd = "";
         }
@@ -366,6 +611,7 @@ void loop() {
   do {
     checkInput();
 
+    scheduler.scanStart(millis());
     int n;
     if (ssid.isEmpty()) n=scanNetworks();
     else {
@@ -392,12 +638,26 @@ void loop() {
             scans.push_back(0);
         }
         if (scans.size()>SCANS_COUNT) scans.erase(scans.begin());
+
+        //history of the network APs
+        uint32_t now = millis()/1000;
+        for (auto &a : aps) if (a.name == ssid) {
+            int32_t rssi = 0;
+            for (int i=0; i<n; i++) if (memcmp(WiFi.BSSID(i),a.bssid,6) == 0) rssi = WiFi.RSSI(i);
+            history.append(a.history, now, rssi);
+        }
+    }
+
+    if (millis()/1000-history_compacted > HISTORY_COMPACT_PERIOD) {
+        history_compacted = millis()/1000;
+        history.compact(history_compacted);
     }
 
 
     if (ssid.isEmpty()) {
         if (useXterm) {
-            drawMode0Xterm(n);
+            if (vmode==2) drawChannelsXterm();
+            else drawMode0Xterm(n);
         } else {
             drawMode0(n);
         }
@@ -409,8 +669,10 @@ void loop() {
             drawMode1(ssid);
         }
     }
-    
-    delay(scandelay);
+
+    //scan and drawing are the active part; keep the idle time steady while a network graph is shown
+    scheduler.scanEnd(millis(), ssid.isEmpty() ? scan_change : -1);
+    idle();
   } while (true);
 }
 
@@ -423,6 +685,7 @@ void writeBot(int row) {
 }
 bool writeScreen() {
   xterm.clear();
+  if (vmode==2) return writeScreenChannels();
 
                  //00000000011111111112222222222333333333344444444445555555555666
                  //12345678901234567890123456789012345678901234567890123456789012
@@ -436,6 +699,18 @@ bool writeScreen() {
   return true;
 }
 
+bool writeScreenChannels() {
+                 //00000000011111111112222222222333333333344444444445555555555666
+                 //12345678901234567890123456789012345678901234567890123456789012
+  xterm.print(1,1,"╔════╦═════╦═══════╦══════╦══════╦════════════════════════════════╗",NORMAL); 
+  xterm.print(2,1,"║ Ch ║ APs ║ Power ║  Max ║  Min ║ █ channel  ░ overlapping       ║",NORMAL); 
+  xterm.print(3,1,"╠════╬═════╬═══════╬══════╬══════╬════════════════════════════════╣",NORMAL); 
+  for (int ch=1; ch<=CHANNELS_COUNT; ch++) 
+    xterm.print(ch+3,1,"║    ║     ║       ║      ║      ║                                ║",NORMAL); 
+  xterm.print(CHANNELS_COUNT+4,1,"╚════╩═════╩═══════╩══════╩══════╩════════════════════════════════╝",NORMAL); 
+  return true;
+}
+
 bool writeScreen1(String ssid) {
   xterm.clear();
 
@@ -518,7 +793,11 @@ void drawMode0Xterm(int n) {
    
         i++;
     }
-    xterm.printf(rc+5,1,NORMAL,"found %d networks; uptime %d seconds      ",n,millis()/1000);
+    //status lines move down with the list: clear the rest of the line (\e[K)
+    xterm.printf(rc+5,1,NORMAL,"found %d networks; uptime %d seconds\e[K",n,millis()/1000);
+    xterm.printf(rc+6,1,NORMAL,"history %u samples; %u kB; %u.%02u bits/sample\e[K",
+        history.samples(),history.usedBytes()/1024,history.bitsPerSample()/100,history.bitsPerSample()%100);
+    xterm.printf(rc+7,1,NORMAL,"%s\e[K",powerStat().c_str());
 }
 
 void drawMode0(int n) {
@@ -529,6 +808,7 @@ void drawMode0(int n) {
     });
 
     Serial.printf("========%d sec; %d networks=====\n",millis()/1000,n);
+    if (scheduler.mode!=POWER_AWAKE) Serial.printf("%s\n",powerStat().c_str());
     if (vmode==1) 
         Serial.printf("# | RSSI | Avg | lost | delay | mesh | cnt | encr | Name\n",millis()/1000,n);
     else
@@ -703,4 +983,37 @@ void drawMode1(String ssid) {
 
     Serial.printf("%d ",scans.back());
     Serial.printf("%s\n",res.c_str());
-};
\ No newline at end of file
+};
+
+int powerToDbm(uint64_t power) {
+    return power ? (int)lround(10*log10((double)power))-120 : 0;
+}
+
+//bar length for the power: CHANNEL_BAR_MIN..CHANNEL_BAR_MAX -> 0..width
+int channelBar(uint64_t power, int width) {
+    if (power==0) return 0;
+    int c = width*(powerToDbm(power)-CHANNEL_BAR_MIN)/(CHANNEL_BAR_MAX-CHANNEL_BAR_MIN);
+    return c<1 ? 1 : (c>width ? width : c);
+}
+
+void drawChannelsXterm() {
+    //only the aggregates are used: O(channels) per frame
+    const int width = 30;
+    for (int ch=1; ch<=CHANNELS_COUNT; ch++) {
+        channeltype &c = channels[ch];
+
+        //2.4GHz channels overlap with 4 neighbours on each side
+        uint64_t overlap = 0;
+        for (int i=ch-4; i<=ch+4; i++) if (i>=1 && i<=CHANNELS_COUNT) overlap += channels[i].power;
+
+        int own = channelBar(c.power,width);
+        int all = channelBar(overlap,width);
+        String bar = "";
+        for (int i=0; i<width; i++) bar += i<own ? "█" : (i<all ? "░" : " ");
+
+        if (c.count) xterm.printf(ch+3,2,NORMAL," %2d ║ %3d ║ %4d  ║ %4d ║ %4d ║ %s",ch,c.count,powerToDbm(c.power),c.strongest,c.weakest,bar.c_str());
+        else xterm.printf(ch+3,2,NORMAL," %2d ║     ║       ║      ║      ║ %s",ch,bar.c_str());
+    }
+    xterm.printf(CHANNELS_COUNT+5,1,NORMAL,"%d networks; %d APs; uptime %d seconds\e[K",data.size(),aps.size(),millis()/1000);
+    xterm.printf(CHANNELS_COUNT+6,1,NORMAL,"%s\e[K",powerStat().c_str());
+}
@@ -0,0 +1,167 @@
+/*
+Scan duty cycling.
+
+The scheduler only decides when to scan and how long to sleep; the caller
+supplies the clock (ms) and does the sleeping, so the logic can run on the
+host with a virtual clock.
+
+The idle time after a scan starts at `scandelay`. In power saving modes it
+grows by 1/4 per scan while the networks do not change and halves when they
+do, up to SCHED_MAX_FACTOR times `scandelay`. Any input brings it back to
+`scandelay`. A network has changed when its rssi moved by SCHED_CHANGE_DB or
+more, or it appeared, disappeared or moved to another channel: the rssi of a
+still network jumps by a few dB from scan to scan, so an average of the
+changes would never look quiet.
+
+In light sleep the character that wakes the chip is lost, so after any input
+the chip stays awake for SCHED_INPUT_WINDOW and polls the input like in modem
+sleep.
+
+Energy is estimated from the time spent in every state and the typical
+power of the state.
+*/
+#pragma once
+
+#include <stdint.h>
+
+typedef enum{
+    POWER_AWAKE=0,  //delay() between scans, as before
+    POWER_MODEM=1,  //radio off, low cpu frequency
+    POWER_LIGHT=2,  //light sleep, wake on timer or uart
+}POWERMODE;
+
+//typical power at 3.3V, mW
+#define POWER_SCAN_MW 330
+#define POWER_AWAKE_MW 130
+#define POWER_MODEM_MW 80   //radio off, cpu at 80MHz: ~24mA
+#define POWER_LIGHT_MW 3
+
+#define SCHED_MAX_FACTOR 16
+//dB; smaller rssi changes are noise
+#define SCHED_CHANGE_DB 6
+//percent of the networks changed in a scan
+#define SCHED_CHANGE_LOW 5
+#define SCHED_CHANGE_HIGH 20
+//ms; longest sleep without looking at the input when the uart can not wake us
+#define SCHED_POLL 50
+//ms; stay awake after input in light sleep mode
+#define SCHED_INPUT_WINDOW 10000
+
+//percent of the networks changed: `changed` of `active`
+inline int scanChange(int changed, int active) {
+    return active ? changed*100/active : 0;
+}
+
+class ScanScheduler
+{
+public:
+    POWERMODE mode = POWER_AWAKE;
+
+    //ms of idle time after a scan when nothing changes fast
+    void setInterval(uint32_t ms) {
+        if (ms==_base) return;
+        _base = ms;
+        if (_interval<_base || mode==POWER_AWAKE) _interval = _base;
+        if (_interval>_base*SCHED_MAX_FACTOR) _interval = _base*SCHED_MAX_FACTOR;
+    }
+
+    void scanStart(uint32_t now) {
+        if (_scanning) return;
+        if (_scans) {
+            uint32_t awake = _awakeTime+awakeTime(now);
+            uint32_t idle = now-_idleStart;
+            if (awake>idle) awake = idle;
+            addTime(awake, POWER_MODEM_MW);
+            addTime(idle-awake, idlePower());
+        }
+        _awakeTime = 0;
+        _scanStart = now;
+        _scanning = true;
+    }
+
+    //change: percent of the networks changed (scanChange()), <0 - do not adapt
+    void scanEnd(uint32_t now, int change) {
+        if (!_scanning) return;
+        _scanTime += now-_scanStart;
+        addTime(now-_scanStart, POWER_SCAN_MW);
+        _scanning = false;
+        _scans++;
+
+        if (mode==POWER_AWAKE || change<0) _interval = _base;
+        else if (change>=SCHED_CHANGE_HIGH) _interval /= 2;
+        else if (change<=SCHED_CHANGE_LOW) _interval += _interval/4;
+        if (_interval<_base) _interval = _base;
+        if (_interval>_base*SCHED_MAX_FACTOR) _interval = _base*SCHED_MAX_FACTOR;
+
+        _idleStart = now;
+        _next = now+_interval;
+    }
+
+    //user is here: go back to the fast scan and keep awake for more input
+    void input(uint32_t now) {
+        _interval = _base;
+        if (!_scanning && (int32_t)(_next-(now+_base))>0) _next = now+_base;
+        if (mode!=POWER_LIGHT) return;
+        if (!awake(now)) {
+            _awakeTime += awakeTime(now);
+            _awakeFrom = now;
+        }
+        _awakeUntil = now+SCHED_INPUT_WINDOW;
+    }
+
+    //light sleep is allowed now (no uart wake needed)
+    bool lightSleep(uint32_t now) const {
+        return mode==POWER_LIGHT && !awake(now);
+    }
+
+    //ms to sleep now; 0 - time to scan
+    uint32_t sleepTime(uint32_t now) const {
+        if (_scanning || (int32_t)(_next-now)<=0) return 0;
+        uint32_t t = _next-now;
+        if (!lightSleep(now) && t>SCHED_POLL) t = SCHED_POLL;
+        return t;
+    }
+
+    uint32_t interval() const { return _interval; }
+    uint32_t scans() const { return _scans; }
+    //permille of time spent scanning
+    uint32_t dutyCycle() const { return _time ? (uint64_t)_scanTime*1000/_time : 0; }
+    uint32_t energyPerScan() const { return _scans ? _energy/_scans/1000 : 0; } //mJ
+    uint32_t averagePower() const { return _time ? _energy/_time : 0; }         //mW
+
+private:
+    uint32_t idlePower() const {
+        switch (mode) {
+            case POWER_MODEM: return POWER_MODEM_MW;
+            case POWER_LIGHT: return POWER_LIGHT_MW;
+            default: return POWER_AWAKE_MW;
+        }
+    }
+    bool awake(uint32_t now) const {
+        return (int32_t)(_awakeUntil-now)>0;
+    }
+    //part of the input window inside the current idle time, up to now
+    uint32_t awakeTime(uint32_t now) const {
+        uint32_t from = (int32_t)(_awakeFrom-_idleStart)>0 ? _awakeFrom : _idleStart;
+        uint32_t to = awake(now) ? now : _awakeUntil;
+        return (int32_t)(to-from)>0 ? to-from : 0;
+    }
+    void addTime(uint32_t ms, uint32_t mw) {
+        _time += ms;
+        _energy += (uint64_t)ms*mw;
+    }
+
+    uint32_t _base = 1000;
+    uint32_t _interval = 1000;
+    uint32_t _next = 0;
+    uint32_t _scanStart = 0;
+    uint32_t _idleStart = 0;
+    bool _scanning = false;
+    uint32_t _awakeFrom = 0;
+    uint32_t _awakeUntil = 0;
+    uint32_t _awakeTime = 0;  //input windows of this idle time that are over
+    uint32_t _scans = 0;
+    uint64_t _scanTime = 0;
+    uint64_t _time = 0;
+    uint64_t _energy = 0;  //uJ
+};
@@ -0,0 +1,237 @@
+/*
+RssiHistory on the host: pio test -e native
+*/
+#include <unity.h>
+#include <chrono>
+#include <stdio.h>
+#include "history.h"
+
+//deterministic noise
+static uint32_t seed = 1;
+static int rnd(int n) {
+    seed = seed*1103515245+12345;
+    return (seed>>16)%n;
+}
+
+struct sample {
+    uint32_t t;
+    int8_t rssi;
+};
+
+//samples of a typical scan: 3-4 s period, +-2 dB noise, some losses
+static std::vector<sample> scan(uint32_t t, int count, int rssi, int period=3, int jitter=2) {
+    std::vector<sample> v;
+    for (int i=0; i<count; i++) {
+        t += period+rnd(jitter);
+        v.push_back(sample{t,(int8_t)(rnd(20)==0 ? 0 : rssi+rnd(5)-2)});
+    }
+    return v;
+}
+
+static std::vector<sample> all(RssiHistory &h, int s, uint32_t from=0, uint32_t to=UINT32_MAX) {
+    std::vector<sample> v;
+    h.query(s,from,to,[&](uint32_t t, int8_t r){ v.push_back(sample{t,r}); });
+    return v;
+}
+
+//mean rssi of the received samples
+static double mean(const std::vector<sample> &v) {
+    double sum = 0;
+    int n = 0;
+    for (const sample &x : v) if (x.rssi) {
+        sum += x.rssi;
+        n++;
+    }
+    return n ? sum/n : 0;
+}
+
+void setUp() {
+    seed = 1;
+}
+
+void tearDown() {
+}
+
+void test_roundtrip() {
+    RssiHistory h;
+    TEST_ASSERT_TRUE(h.begin(64));
+    int s = h.addSeries();
+
+    //steady, jitter, lost, big jumps, a long gap and the range ends
+    std::vector<sample> v = scan(100,500,-70);
+    uint32_t t = v.back().t;
+    int8_t extra[] = {0,0,-127,-1,-30,-100,0,-100,-99};
+    for (int8_t r : extra) v.push_back(sample{t+=3,r});
+    v.push_back(sample{t+=100000,-50});
+    v.push_back(sample{t+=1,-50});
+
+    for (sample &x : v) TEST_ASSERT_TRUE(h.append(s,x.t,x.rssi));
+    TEST_ASSERT_EQUAL_UINT32(v.size(),h.samples());
+
+    std::vector<sample> got = all(h,s);
+    TEST_ASSERT_EQUAL_INT(v.size(),got.size());
+    for (size_t i=0; i<v.size(); i++) {
+        TEST_ASSERT_EQUAL_UINT32(v[i].t,got[i].t);
+        TEST_ASSERT_EQUAL_INT(v[i].rssi,got[i].rssi);
+    }
+}
+
+void test_series_are_separate() {
+    RssiHistory h;
+    h.begin(64);
+    int a = h.addSeries();
+    int b = h.addSeries();
+    for (uint32_t t=1; t<1000; t+=3) {
+        h.append(a,t,-40);
+        h.append(b,t,-80);
+    }
+    for (sample &x : all(h,a)) TEST_ASSERT_EQUAL_INT(-40,x.rssi);
+    for (sample &x : all(h,b)) TEST_ASSERT_EQUAL_INT(-80,x.rssi);
+    TEST_ASSERT_EQUAL_INT(0,all(h,2).size());
+}
+
+void test_range_query() {
+    RssiHistory h;
+    h.begin(64);
+    int s = h.addSeries();
+    std::vector<sample> v = scan(0,3000,-60);
+    for (sample &x : v) h.append(s,x.t,x.rssi);
+
+    uint32_t ranges[][2] = {{0,UINT32_MAX},{0,0},{v[100].t,v[100].t},{v[700].t+1,v[2500].t},{v.back().t,UINT32_MAX},{v.back().t+1,UINT32_MAX}};
+    for (auto &r : ranges) {
+        size_t n = 0;
+        for (sample &x : v) if (x.t>=r[0] && x.t<=r[1]) n++;
+        std::vector<sample> got = all(h,s,r[0],r[1]);
+        TEST_ASSERT_EQUAL_INT(n,got.size());
+        for (sample &x : got) TEST_ASSERT_TRUE(x.t>=r[0] && x.t<=r[1]);
+    }
+}
+
+void test_compaction() {
+    RssiHistory h;
+    h.begin(256);
+    int s = h.addSeries();
+    std::vector<sample> v = scan(0,20000,-60);
+
+    //nothing is old enough yet
+    for (size_t i=0; i<150; i++) h.append(s,v[i].t,v[i].rssi);
+    h.compact(v[149].t);
+    TEST_ASSERT_EQUAL_UINT32(150,h.samples());
+    //clock before the data
+    h.compact(0);
+    TEST_ASSERT_EQUAL_UINT32(150,h.samples());
+
+    for (size_t i=150; i<v.size(); i++) h.append(s,v[i].t,v[i].rssi);
+    uint32_t samples = h.samples();
+    uint32_t bytes = h.usedBytes();
+
+    h.compact(v.back().t+HISTORY_DOWNSAMPLE_AGE*100);
+    TEST_ASSERT_LESS_THAN_UINT32(samples,h.samples());
+    TEST_ASSERT_LESS_THAN_UINT32(bytes,h.usedBytes());
+
+    std::vector<sample> got = all(h,s);
+    TEST_ASSERT_EQUAL_INT(h.samples(),got.size());
+    TEST_ASSERT_EQUAL_UINT32(v[0].t,got[0].t);
+    for (size_t i=1; i<got.size(); i++) TEST_ASSERT_TRUE(got[i-1].t<got[i].t);
+    //averages stay inside the noise
+    for (sample &x : got) TEST_ASSERT_TRUE(x.rssi==0 || (x.rssi>=-62 && x.rssi<=-58));
+    //and the mean is kept after several levels of downsampling
+    TEST_ASSERT_TRUE(mean(got)>mean(v)-0.2 && mean(got)<mean(v)+0.2);
+    //the block being written is not touched
+    TEST_ASSERT_EQUAL_UINT32(v.back().t,got.back().t);
+    TEST_ASSERT_EQUAL_INT(v.back().rssi,got.back().rssi);
+}
+
+void test_eviction() {
+    RssiHistory h;
+    h.begin(8);
+    int a = h.addSeries();
+    int b = h.addSeries();
+    uint32_t t = 0;
+    for (int i=0; i<5000; i++) {
+        t += 3;
+        TEST_ASSERT_TRUE(h.append(a,t,-50-rnd(5)));
+        TEST_ASSERT_TRUE(h.append(b,t,-70-rnd(5)));
+    }
+    TEST_ASSERT_EQUAL_UINT32(h.totalBytes(),h.usedBytes());
+
+    //the oldest data is gone, the newest is still there
+    std::vector<sample> ga = all(h,a);
+    std::vector<sample> gb = all(h,b);
+    TEST_ASSERT_TRUE(ga.front().t>3);
+    TEST_ASSERT_EQUAL_UINT32(t,ga.back().t);
+    TEST_ASSERT_EQUAL_UINT32(t,gb.back().t);
+    TEST_ASSERT_EQUAL_UINT32(h.samples(),ga.size()+gb.size());
+}
+
+void test_full_pool() {
+    //a single block per series can not be evicted
+    RssiHistory h;
+    h.begin(1);
+    int a = h.addSeries();
+    int b = h.addSeries();
+    TEST_ASSERT_TRUE(h.append(a,1,-50));
+    TEST_ASSERT_FALSE(h.append(b,1,-50));
+    h.clear();
+    TEST_ASSERT_EQUAL_UINT32(0,h.samples());
+    TEST_ASSERT_EQUAL_UINT32(0,h.usedBytes());
+}
+
+void test_bits_per_sample() {
+    char msg[100];
+    int periods[][2] = {{3,1},{3,2}};
+    for (auto &p : periods) {
+        RssiHistory h;
+        h.begin(1024);
+        int s = h.addSeries();
+        for (sample &x : scan(0,50000,-65,p[0],p[1])) h.append(s,x.t,x.rssi);
+        snprintf(msg,sizeof(msg),"period %d-%d s, +-2 dB: %u.%02u bits/sample",p[0],p[0]+p[1]-1,h.bitsPerSample()/100,h.bitsPerSample()%100);
+        TEST_MESSAGE(msg);
+        TEST_ASSERT_LESS_THAN_UINT32(900,h.bitsPerSample());
+    }
+
+    //constant period and rssi
+    RssiHistory h;
+    h.begin(1024);
+    int s = h.addSeries();
+    for (uint32_t t=0; t<150000; t+=3) h.append(s,t,-65);
+    snprintf(msg,sizeof(msg),"constant: %u.%02u bits/sample",h.bitsPerSample()/100,h.bitsPerSample()%100);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_LESS_THAN_UINT32(300,h.bitsPerSample());
+}
+
+void test_decode_throughput() {
+    RssiHistory h;
+    h.begin(16384);
+    std::vector<int> series;
+    for (int i=0; i<300; i++) {
+        series.push_back(h.addSeries());
+        for (sample &x : scan(0,3600,-40-rnd(50))) h.append(series.back(),x.t,x.rssi);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    long n = 0;
+    long sum = 0;
+    for (int rep=0; rep<3; rep++)
+        for (int s : series) n += h.query(s,0,UINT32_MAX,[&](uint32_t, int8_t r){ sum += r; });
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+    char msg[100];
+    snprintf(msg,sizeof(msg),"decode: %.1f Msamples/s (%ld samples)",n/sec/1e6,n);
+    TEST_MESSAGE(msg);
+    TEST_ASSERT_EQUAL_INT(3L*h.samples(),n);
+    TEST_ASSERT_TRUE(sum<0);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_roundtrip);
+    RUN_TEST(test_series_are_separate);
+    RUN_TEST(test_range_query);
+    RUN_TEST(test_compaction);
+    RUN_TEST(test_eviction);
+    RUN_TEST(test_full_pool);
+    RUN_TEST(test_bits_per_sample);
+    RUN_TEST(test_decode_throughput);
+    return UNITY_END();
+}
@@ -0,0 +1,269 @@
+/*
+ScanScheduler on the host with a virtual clock: pio test -e native
+*/
+#include <unity.h>
+#include <stdio.h>
+#include <vector>
+#include <stdlib.h>
+#include "powersave.h"
+
+#define SCAN_MS 2500
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+static void cycle(ScanScheduler &s, uint32_t &now, int change) {
+    s.scanStart(now);
+    now += SCAN_MS;
+    s.scanEnd(now,change);
+    while (uint32_t t = s.sleepTime(now)) now += t;
+}
+
+void test_awake_keeps_interval() {
+    ScanScheduler s;
+    s.setInterval(1000);
+    uint32_t now = 0;
+    for (int i=0; i<20; i++) {
+        cycle(s,now,0);
+        TEST_ASSERT_EQUAL_UINT32(1000,s.interval());
+    }
+    TEST_ASSERT_EQUAL_UINT32(20*(SCAN_MS+1000),now);
+}
+
+void test_interval_adapts() {
+    ScanScheduler s;
+    s.mode = POWER_MODEM;
+    s.setInterval(1000);
+    uint32_t now = 0;
+
+    //quiet: grows by 1/4 up to the limit
+    cycle(s,now,SCHED_CHANGE_LOW);
+    TEST_ASSERT_EQUAL_UINT32(1250,s.interval());
+    for (int i=0; i<30; i++) cycle(s,now,0);
+    TEST_ASSERT_EQUAL_UINT32(1000*SCHED_MAX_FACTOR,s.interval());
+
+    //some change: kept
+    cycle(s,now,SCHED_CHANGE_LOW+1);
+    TEST_ASSERT_EQUAL_UINT32(1000*SCHED_MAX_FACTOR,s.interval());
+
+    //a lot of change: halves down to the base
+    cycle(s,now,SCHED_CHANGE_HIGH);
+    TEST_ASSERT_EQUAL_UINT32(1000*SCHED_MAX_FACTOR/2,s.interval());
+    for (int i=0; i<10; i++) cycle(s,now,100);
+    TEST_ASSERT_EQUAL_UINT32(1000,s.interval());
+
+    //graph mode does not adapt
+    for (int i=0; i<5; i++) cycle(s,now,0);
+    cycle(s,now,-1);
+    TEST_ASSERT_EQUAL_UINT32(1000,s.interval());
+
+    //+/- keys
+    for (int i=0; i<30; i++) cycle(s,now,0);
+    s.setInterval(500);
+    TEST_ASSERT_EQUAL_UINT32(500*SCHED_MAX_FACTOR,s.interval());
+    s.setInterval(20000);
+    TEST_ASSERT_EQUAL_UINT32(20000,s.interval());
+}
+
+//deterministic noise
+static uint32_t seed = 1;
+static int rnd(int n) {
+    seed = seed*1103515245+12345;
+    return (seed>>16)%n;
+}
+
+//rssi of still networks: +-2 dB noise around the level
+static int noisyScan(std::vector<int> &last, const std::vector<int> &level) {
+    int changed = 0;
+    for (size_t i=0; i<last.size(); i++) {
+        int rssi = level[i]+rnd(5)-2;
+        if (abs(rssi-last[i])>=SCHED_CHANGE_DB) changed++;
+        last[i] = rssi;
+    }
+    return scanChange(changed,last.size());
+}
+
+void test_noise_is_quiet() {
+    ScanScheduler s;
+    s.mode = POWER_MODEM;
+    s.setInterval(1000);
+    uint32_t now = 0;
+
+    std::vector<int> level;
+    for (int i=0; i<30; i++) level.push_back(-40-rnd(50));
+    std::vector<int> last = level;
+
+    //mean |delta| of the noise is ~1.6 dB, but nothing changed
+    for (int i=0; i<30; i++) cycle(s,now,noisyScan(last,level));
+    TEST_ASSERT_EQUAL_UINT32(1000*SCHED_MAX_FACTOR,s.interval());
+
+    //a third of the networks move by 10 dB
+    for (int i=0; i<10; i++) level[i] -= 10;
+    cycle(s,now,noisyScan(last,level));
+    TEST_ASSERT_EQUAL_UINT32(1000*SCHED_MAX_FACTOR/2,s.interval());
+
+    //one of 30 networks appears
+    TEST_ASSERT_TRUE(scanChange(1,30)<=SCHED_CHANGE_LOW);
+}
+
+void test_input_brings_the_scan_closer() {
+    ScanScheduler s;
+    s.mode = POWER_MODEM;
+    s.setInterval(1000);
+    uint32_t now = 0;
+    for (int i=0; i<30; i++) cycle(s,now,0);
+
+    s.scanStart(now);
+    now += SCAN_MS;
+    s.scanEnd(now,0);
+    TEST_ASSERT_EQUAL_UINT32(1000*SCHED_MAX_FACTOR,s.interval());
+    now += 2000;
+    s.input(now);
+    TEST_ASSERT_EQUAL_UINT32(1000,s.interval());
+
+    uint32_t slept = 0;
+    while (uint32_t t = s.sleepTime(now)) {
+        TEST_ASSERT_LESS_OR_EQUAL_UINT32(SCHED_POLL,t);
+        now += t;
+        slept += t;
+    }
+    TEST_ASSERT_EQUAL_UINT32(1000,slept);
+}
+
+void test_duty_and_energy() {
+    ScanScheduler s;
+    s.setInterval(1000);
+    uint32_t now = 0;
+    for (int i=0; i<10; i++) cycle(s,now,0);
+    s.scanStart(now);
+
+    //10 scans and 10 idle times of the same length
+    TEST_ASSERT_EQUAL_UINT32(10,s.scans());
+    uint64_t energy = 10ULL*SCAN_MS*POWER_SCAN_MW+10ULL*1000*POWER_AWAKE_MW;
+    TEST_ASSERT_EQUAL_UINT32(SCAN_MS*1000/(SCAN_MS+1000),s.dutyCycle());
+    TEST_ASSERT_EQUAL_UINT32(energy/10/1000,s.energyPerScan());
+    TEST_ASSERT_EQUAL_UINT32(energy/now,s.averagePower());
+}
+
+void test_light_sleep_energy() {
+    ScanScheduler s;
+    s.mode = POWER_LIGHT;
+    s.setInterval(5000);
+
+    s.scanStart(0);
+    s.scanEnd(1000,-1);
+    TEST_ASSERT_TRUE(s.lightSleep(1000));
+    TEST_ASSERT_EQUAL_UINT32(5000,s.sleepTime(1000));
+
+    //input at 2000: awake (polling) until 12000
+    s.input(2000);
+    TEST_ASSERT_FALSE(s.lightSleep(2000));
+    TEST_ASSERT_EQUAL_UINT32(SCHED_POLL,s.sleepTime(2000));
+
+    s.scanStart(6000);
+    s.scanEnd(7000,-1);
+    //2 scans, 1000 ms light sleep, 4000 ms awake
+    uint64_t energy = 2ULL*1000*POWER_SCAN_MW+1000ULL*POWER_LIGHT_MW+4000ULL*POWER_MODEM_MW;
+    TEST_ASSERT_EQUAL_UINT32(energy/2/1000,s.energyPerScan());
+    TEST_ASSERT_EQUAL_UINT32(energy/7000,s.averagePower());
+
+    //the window goes on after the scan, then light sleep again
+    TEST_ASSERT_FALSE(s.lightSleep(11999));
+    TEST_ASSERT_TRUE(s.lightSleep(12000));
+    s.scanStart(12000);
+    energy += 5000ULL*POWER_MODEM_MW;
+    TEST_ASSERT_EQUAL_UINT32(energy/2/1000,s.energyPerScan());
+}
+
+struct result {
+    uint32_t worst = 0;  //ms from a key to reading it
+    int received = 0;
+    int lost = 0;        //woke the chip from light sleep
+    int keys = 0;
+};
+
+//a device on a virtual clock; keys typed in pairs: the second one 300 ms after the first
+static result simulate(POWERMODE mode) {
+    ScanScheduler s;
+    s.mode = mode;
+    s.setInterval(1000);
+
+    std::vector<uint32_t> keys;
+    for (uint32_t t=50000; t<3600000; t+=97000) {
+        keys.push_back(t);
+        keys.push_back(t+300);
+    }
+
+    result r;
+    r.keys = keys.size();
+    uint32_t now = 0;
+    size_t k = 0;
+    while (now<3600000) {
+        s.scanStart(now);
+        now += SCAN_MS;
+        //keys typed during a scan are read after it
+        for (; k<keys.size() && keys[k]<=now; k++) {
+            r.received++;
+            s.input(now);
+        }
+        s.scanEnd(now,0);
+
+        while (uint32_t t = s.sleepTime(now)) {
+            if (k<keys.size() && keys[k]<now+t) {
+                if (s.lightSleep(now)) {
+                    //uart wake, the character is lost
+                    now = keys[k++];
+                    r.lost++;
+                    s.input(now);
+                    continue;
+                }
+                now += t;
+                for (; k<keys.size() && keys[k]<=now; k++) {
+                    if (now-keys[k]>r.worst) r.worst = now-keys[k];
+                    r.received++;
+                    s.input(now);
+                }
+                continue;
+            }
+            now += t;
+        }
+    }
+
+    char msg[100];
+    snprintf(msg,sizeof(msg),"mode %d: scan duty %u.%u%%, %u mJ/scan, avg %u mW, worst input latency %u ms",
+        mode,s.dutyCycle()/10,s.dutyCycle()%10,s.energyPerScan(),s.averagePower(),r.worst);
+    TEST_MESSAGE(msg);
+    return r;
+}
+
+void test_input_latency_modem() {
+    result r = simulate(POWER_MODEM);
+    TEST_ASSERT_EQUAL_INT(0,r.lost);
+    TEST_ASSERT_EQUAL_INT(r.keys,r.received);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(SCHED_POLL,r.worst);
+}
+
+void test_input_latency_light() {
+    result r = simulate(POWER_LIGHT);
+    //only the first key of a pair can be lost; the second one is read while awake
+    TEST_ASSERT_TRUE(r.lost>0);
+    TEST_ASSERT_TRUE(r.lost<=r.keys/2);
+    TEST_ASSERT_EQUAL_INT(r.keys,r.received+r.lost);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(SCHED_POLL,r.worst);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_awake_keeps_interval);
+    RUN_TEST(test_interval_adapts);
+    RUN_TEST(test_noise_is_quiet);
+    RUN_TEST(test_input_brings_the_scan_closer);
+    RUN_TEST(test_duty_and_energy);
+    RUN_TEST(test_light_sleep_energy);
+    RUN_TEST(test_input_latency_modem);
+    RUN_TEST(test_input_latency_light);
+    return UNITY_END();
+}